@@ -0,0 +1,47 @@
+#ifndef KNN_AFFINITY_H
+#define KNN_AFFINITY_H
+
+#include <mpi.h>
+
+/**
+ * @brief OpenMP thread pinning policy.
+ */
+enum knn_bind
+{
+    KNN_BIND_NONE,   /**< Leave placement to the OS. */
+    KNN_BIND_CLOSE,  /**< Pin threads to consecutive allowed cpus. */
+    KNN_BIND_SPREAD, /**< Pin threads evenly across the allowed cpus. */
+};
+
+/**
+ * @brief Parses a pinning policy name (none, close or spread).
+ *
+ * @param[in]   name    Policy name.
+ * @param[out]  bind    Pinning policy.
+ * @return On failure returns zero.
+ */
+int knn_parse_bind(char const *name, enum knn_bind *bind);
+
+/**
+ * @brief Pins every thread of the OpenMP team to one of the cpus the
+ * process is allowed to run on.
+ *
+ * Processes of the same node allowed on the same cpus (launched unbound)
+ * get disjoint slices of them. If there are fewer cpus than such processes
+ * threads are left unpinned. Collective over @p comm .
+ *
+ * @param   bind    Pinning policy.
+ * @param   comm    Communicator of every process.
+ * @return On failure returns zero.
+ */
+int knn_bind_threads(enum knn_bind bind, MPI_Comm comm);
+
+/**
+ * @brief Reports where every thread of the OpenMP team is running.
+ *
+ * @param       nt          Number of threads.
+ * @param[out]  placement   Array of @p nt cpu and NUMA node pairs.
+ */
+void knn_thread_placement(int nt, int *placement);
+
+#endif
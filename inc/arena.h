@@ -0,0 +1,78 @@
+#ifndef KNN_ARENA_H
+#define KNN_ARENA_H
+
+#include <stddef.h>
+
+#define KNN_ARENA_ALIGNMENT 64
+#define KNN_ARENA_PAGE 4096
+#define KNN_ARENA_MIN_BLOCK (1 << 20)
+
+/**
+ * @brief Arena memory block (opaque).
+ */
+struct knn_arena_block;
+
+/**
+ * @brief Per-rank bump allocator for pipeline buffers.
+ *
+ * Every allocation is @c KNN_ARENA_ALIGNMENT bytes aligned. Memory is only
+ * released by @p knn_arena_reset (keeps the address space for the next run)
+ * or @p knn_arena_free .
+ */
+typedef struct knn_arena
+{
+    struct knn_arena_block *head;
+    size_t capacity;
+} knn_arena;
+
+/**
+ * @brief Initializes an arena.
+ *
+ * @param[out]  arena       Arena.
+ * @param       capacity    Initial capacity in bytes (may be zero).
+ * @return On failure returns zero.
+ */
+int knn_arena_init(knn_arena *arena, size_t capacity);
+
+/**
+ * @brief Allocates an aligned buffer from the arena.
+ *
+ * Blocks are left untouched (and emptied on reset), so pages are placed on
+ * the NUMA node of the first thread that writes them in every run.
+ *
+ * @param[inout]    arena   Arena.
+ * @param           size    Size in bytes.
+ * @return On failure returns NULL.
+ */
+void *knn_arena_alloc(knn_arena *arena, size_t size);
+
+/**
+ * @brief Allocates a buffer from the arena with a stricter alignment.
+ *
+ * @param[inout]    arena       Arena.
+ * @param           size        Size in bytes.
+ * @param           alignment   Power of two from @c KNN_ARENA_ALIGNMENT to @c KNN_ARENA_PAGE .
+ * @return On failure returns NULL.
+ */
+void *knn_arena_alloc_aligned(knn_arena *arena, size_t size, size_t alignment);
+
+/**
+ * @brief Releases every allocation but keeps the memory for reuse.
+ *
+ * If the arena grew past its first block, blocks are merged into a single
+ * one of the whole capacity so the next run does not grow again. Used pages
+ * are returned to the OS, so the next run first-touch places them again
+ * instead of inheriting the placement of the previous one.
+ *
+ * @param[inout]    arena   Arena.
+ */
+void knn_arena_reset(knn_arena *arena);
+
+/**
+ * @brief Frees all arena memory.
+ *
+ * @param[inout]    arena   Arena.
+ */
+void knn_arena_free(knn_arena *arena);
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef KNN_CHECKPOINT_H
+#define KNN_CHECKPOINT_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "knn.h"
+
+#define KNN_CHECKPOINT_MAGIC "KNNCKPT2"
+#define KNN_CHECKPOINT_BLOCK 256
+#define KNN_CHECKPOINT_QUEUE 16
+
+/**
+ * @brief Checkpoint file header, identifies the run it belongs to.
+ */
+typedef struct knn_checkpoint_header
+{
+    char magic[8];
+    int k, ndays, first, npredictions, window, metric;
+    uint32_t checksum; /**< Dataset checksum, see @p knn_checkpoint_checksum . */
+    float weights[NHOURS];
+} knn_checkpoint_header;
+
+/**
+ * @brief Block of finished predictions waiting to be written.
+ */
+struct knn_checkpoint_block
+{
+    int first, count;
+    knn_neighbor const *kn;
+};
+
+/**
+ * @brief Append-only checkpoint of finished k-Nearest Neighbors.
+ *
+ * The file is the header followed by one record per finished block: its
+ * first prediction, its prediction count and its k-Nearest Neighbors.
+ * Records are written in order by a background thread.
+ */
+typedef struct knn_checkpoint
+{
+    FILE *file;
+    int k;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct knn_checkpoint_block queue[KNN_CHECKPOINT_QUEUE];
+    int head, count, closing, failed;
+} knn_checkpoint;
+
+/**
+ * @brief Checksums (FNV-1a) dataset rows, so a checkpoint is not resumed
+ * against another or an edited dataset.
+ *
+ * @param[in]   data    Matrix of @p nrows by @c NHOURS .
+ * @param       nrows   Row count.
+ * @return Checksum.
+ */
+uint32_t knn_checkpoint_checksum(float const *data, int nrows);
+
+/**
+ * @brief Opens (or creates) a checkpoint and starts its writer thread.
+ *
+ * If the file exists and belongs to the same run, the k-Nearest Neighbors of
+ * its records are loaded and any partially written record is dropped. A
+ * file shorter than the header (killed right after creation) is started over.
+ *
+ * @param[out]  checkpoint  Checkpoint.
+ * @param[in]   filename    Checkpoint filename.
+ * @param[in]   header      Run header.
+ * @param[out]  kn          Array of @p header npredictions by k neighbors.
+ * @param[out]  done        Number of finished predictions.
+ * @return On failure returns zero.
+ */
+int knn_checkpoint_open(knn_checkpoint *checkpoint, char const *filename, knn_checkpoint_header const *header, knn_neighbor *kn, int *done);
+
+/**
+ * @brief Queues a finished block to be written asynchronously. Only blocks
+ * when the queue is full.
+ *
+ * @param[inout]    checkpoint  Checkpoint.
+ * @param           first       First prediction of the block.
+ * @param           count       Number of predictions of the block.
+ * @param[in]       kn          Block neighbors, must live until @p knn_checkpoint_close .
+ * @return On failure (of this or a previous write) returns zero.
+ */
+int knn_checkpoint_write(knn_checkpoint *checkpoint, int first, int count, knn_neighbor const *kn);
+
+/**
+ * @brief Writes every queued block, stops the writer thread and closes the file.
+ *
+ * @param[inout]    checkpoint  Checkpoint.
+ * @return On failure of any write returns zero.
+ */
+int knn_checkpoint_close(knn_checkpoint *checkpoint);
+
+#endif
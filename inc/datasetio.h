@@ -27,8 +27,33 @@ int knn_allocate_dataset(int ndays, float **data);
  */
 int knn_load_dataset(char const *filename, int *ndays, float **data);
 
-int knn_save_predictions(char const *filename, float *predictions);
+/**
+ * @brief Loads @c NHOURS per-hour weights separated by commas or blanks.
+ *
+ * @param[in]   filename    Input weights filename.
+ * @param[out]  weights     Array of @c NHOURS weights.
+ * @return On failure returns zero.
+ */
+int knn_load_weights(char const *filename, float *weights);
 
-int knn_save_mape(char const *filename, float *mape);
+/**
+ * @brief Saves predictions, one day per line.
+ *
+ * @param[in]   filename        Output filename.
+ * @param       npredictions    Number of predictions.
+ * @param[in]   predictions     Matrix of @p npredictions by @c NHOURS .
+ * @return On failure returns zero.
+ */
+int knn_save_predictions(char const *filename, int npredictions, float *predictions);
+
+/**
+ * @brief Saves prediction errors, one day per line.
+ *
+ * @param[in]   filename        Output filename.
+ * @param       npredictions    Number of predictions.
+ * @param[in]   mape            Array of @p npredictions errors.
+ * @return On failure returns zero.
+ */
+int knn_save_mape(char const *filename, int npredictions, float *mape);
 
 #endif
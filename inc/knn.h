@@ -4,6 +4,13 @@
 #include <stddef.h>
 #include "datasetio.h"
 
+#define KNN_NO_NEIGHBOR (-1)
+#define KNN_TILE_ROWS 256
+#define KNN_TILE_MIN_ROWS 128 /* Fewest rows spanning whole pages (128 by NHOURS floats are 3 pages). */
+#define KNN_THREAD_TILES 4     /* Tiles per thread aimed at, so round-robin tiles even out the causal mask. */
+#define KNN_TARGET_TILE 64
+#define KNN_WORKSPACE_ALIGNMENT 64
+
 /**
  * @brief Chunk index and distance (eval) pair.
  */
@@ -14,15 +21,129 @@ typedef struct knn_neighbor_index_eval_pair
 } knn_neighbor;
 
 /**
- * @brief Find k-Nearest Neighbors.
+ * @brief Distance metrics.
+ */
+enum knn_metric_kind
+{
+    KNN_METRIC_L1,   /**< Sum of absolute differences. */
+    KNN_METRIC_L2,   /**< Sum of squared differences. */
+    KNN_METRIC_WL1,  /**< Sum of per-hour weighted absolute differences. */
+    KNN_METRIC_CORR, /**< One minus the Pearson correlation (shape distance). */
+};
+
+/**
+ * @brief Distance metric and its parameters.
+ */
+typedef struct knn_metric
+{
+    enum knn_metric_kind kind;
+    float weights[NHOURS];
+} knn_metric;
+
+/**
+ * @brief Per-row precomputed statistics, cached alongside the rows.
+ */
+typedef struct knn_row_stats
+{
+    float mean;
+    float scale; /**< One over the root of the sum of squared deviations. */
+} knn_row_stats;
+
+/**
+ * @brief Parses a metric name (l1, l2, wl1 or corr).
  *
- * @param       k       Nearest Neighbors.
- * @param[in]   target  Find close neighbors to.
- * @param[in]   data    Matrix of neighbors of size @p size by @c NHOURS .
+ * @param[in]   name    Metric name.
+ * @param[out]  kind    Metric.
+ * @return On failure returns zero.
+ */
+int knn_parse_metric(char const *name, enum knn_metric_kind *kind);
+
+/**
+ * @brief Precomputes the row statistics @p metric needs (none for L1, L2
+ * and WL1).
+ *
+ * @param[in]   metric  Distance metric.
+ * @param[in]   rows    Matrix of @p nrows by @c NHOURS .
+ * @param       nrows   Row count.
+ * @param[out]  stats   Array of @p nrows statistics.
+ */
+void knn_row_stats_compute(knn_metric const *metric, float const *rows, int nrows, knn_row_stats *stats);
+
+/**
+ * @brief Zeroes a data matrix so its pages land on the NUMA node of their
+ * owner: tile @c t is owned by thread @c t modulo the number of OpenMP
+ * threads. Tiles split the rows in @c KNN_THREAD_TILES per thread, in
+ * multiples of @c KNN_TILE_MIN_ROWS up to @c KNN_TILE_ROWS rows.
+ *
+ * @param[out]  data    Matrix of size @p size by @c NHOURS .
  * @param       size    Data row count.
- * @param[out]  kn      Array of k-Nearest Neighbors to target indexes.
  */
-void knn_kNN(int k, float const *target, float const *data, int size, knn_neighbor *kn);
+void knn_first_touch(float *data, int size);
+
+/**
+ * @brief Find k-Nearest Neighbors of many consecutive target days.
+ *
+ * Blocked all-pairs search: every OpenMP thread scans the tiles it owns
+ * (see @p knn_first_touch ) for blocks of @c KNN_TARGET_TILE targets, then
+ * per target candidates are merged. With fewer than @c KNN_THREAD_TILES
+ * tiles per thread, (target block, tile) pairs are spread over the threads
+ * instead. Only data days strictly before a target
+ * day are neighbors of it (causal mask). The kernel is specialized for the
+ * metric once per call. Missing neighbors (fewer candidates than @p k ) are
+ * left with an infinite eval and a @c KNN_NO_NEIGHBOR index.
+ *
+ * @param           k               Nearest Neighbors.
+ * @param[in]       metric          Distance metric.
+ * @param           ntargets        Number of targets.
+ * @param[in]       targets         Matrix of targets of size @p ntargets by @c NHOURS .
+ * @param[in]       target_stats    Targets statistics.
+ * @param           targets_day     Day of the first target.
+ * @param[in]       data            Matrix of neighbors of size @p size by @c NHOURS .
+ * @param[in]       data_stats      Data rows statistics.
+ * @param           data_day        Day of the first data row.
+ * @param           size            Data row count.
+ * @param[inout]    scratch         Buffer of max threads by @p ntargets by @p k neighbors.
+ * @param[out]      kn              Array of @p ntargets by @p k ascending neighbors (day indexes).
+ */
+void knn_kNN_batch(int k, knn_metric const *metric, int ntargets, float const *targets, knn_row_stats const *target_stats, int targets_day,
+                   float const *data, knn_row_stats const *data_stats, int data_day, int size, knn_neighbor *scratch, knn_neighbor *kn);
+
+/**
+ * @brief Bytes of workspace each OpenMP thread needs in @p knn_kNN_window .
+ *
+ * @param   window  Window days.
+ * @return Workspace bytes, multiple of @c KNN_WORKSPACE_ALIGNMENT .
+ */
+size_t knn_kNN_window_workspace(int window);
+
+/**
+ * @brief Find k-Nearest Neighbors of many consecutive target days, comparing
+ * windows of @p window consecutive days ending at each day.
+ *
+ * Windows are read in place: @p targets and @p data must have @p window - 1
+ * readable rows before them (the halo). Rows whose window starts before day
+ * zero are never neighbors, and only windows ending strictly before a
+ * target day are neighbors of it (causal mask). Window distances are
+ * rolling sums of row distances, so the cost does not grow with @p window
+ * (for @c KNN_METRIC_CORR it is the sum of the per day shape distances).
+ *
+ * @param           k               Nearest Neighbors.
+ * @param[in]       metric          Distance metric.
+ * @param           window          Window days.
+ * @param           ntargets        Number of targets.
+ * @param[in]       targets         Matrix of targets of size @p ntargets by @c NHOURS .
+ * @param[in]       target_stats    Targets statistics, halo included.
+ * @param           targets_day     Day of the first target.
+ * @param[in]       data            Matrix of neighbors of size @p size by @c NHOURS .
+ * @param[in]       data_stats      Data rows statistics, halo included.
+ * @param           data_day        Day of the first data row.
+ * @param           size            Data row count.
+ * @param[inout]    scratch         Buffer of max threads by @p ntargets by @p k neighbors.
+ * @param[out]      workspace       Buffer of max threads by @p knn_kNN_window_workspace bytes.
+ * @param[out]      kn              Array of @p ntargets by @p k ascending neighbors (day indexes).
+ */
+void knn_kNN_window(int k, knn_metric const *metric, int window, int ntargets, float const *targets, knn_row_stats const *target_stats, int targets_day,
+                    float const *data, knn_row_stats const *data_stats, int data_day, int size, knn_neighbor *scratch, void *workspace, knn_neighbor *kn);
 
 /**
  * @brief Bubble sort knn array.
@@ -33,6 +154,32 @@ void knn_kNN(int k, float const *target, float const *data, int size, knn_neighb
  */
 void knn_bubble_sort_array(int k, knn_neighbor *nk, int asc);
 
-void knn_predictions(int k, int ndays, knn_neighbor const *neighbors, float const *data, float *predictions, float *mape);
+/**
+ * @brief Merges sorted lists of @p k neighbors into the @p k nearest.
+ *
+ * A binary heap keeps the next neighbor of every list, so the merge costs
+ * O(k log nlists) instead of sorting all nlists * k neighbors.
+ *
+ * @param       k       Nearest Neighbors.
+ * @param       nlists  Number of lists.
+ * @param[in]   lists   First list, the others every @p stride neighbors.
+ * @param       stride  Neighbors from a list to the next.
+ * @param       asc     Lists are ascending (else descending).
+ * @param[out]  kn      Array of @p k ascending neighbors.
+ */
+void knn_merge_neighbors(int k, int nlists, knn_neighbor const *lists, size_t stride, int asc, knn_neighbor *kn);
+
+/**
+ * @brief Predicts consecutive days as the mean of their neighbors.
+ *
+ * @param       k               Nearest Neighbors.
+ * @param       first           First predicted day.
+ * @param       npredictions    Number of predictions.
+ * @param[in]   neighbors       Array of @p npredictions by @p k neighbors.
+ * @param[in]   data            Dataset data.
+ * @param[out]  predictions     Matrix of @p npredictions by @c NHOURS .
+ * @param[out]  mape            Array of @p npredictions errors.
+ */
+void knn_predictions(int k, int first, int npredictions, knn_neighbor const *neighbors, float const *data, float *predictions, float *mape);
 
 #endif
@@ -0,0 +1,145 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <omp.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "affinity.h"
+
+int knn_parse_bind(char const *name, enum knn_bind *bind)
+{
+    assert(name != NULL);
+    assert(bind != NULL);
+
+    if (strcmp(name, "none") == 0)
+        *bind = KNN_BIND_NONE;
+    else if (strcmp(name, "close") == 0)
+        *bind = KNN_BIND_CLOSE;
+    else if (strcmp(name, "spread") == 0)
+        *bind = KNN_BIND_SPREAD;
+    else
+        return 0;
+
+    return 1;
+}
+
+/**
+ * @brief Lists the cpus of a cpu set.
+ *
+ * @param[in]   set     Cpu set.
+ * @param[out]  cpus    Array of at least @c CPU_SETSIZE cpu ids.
+ * @return Number of cpus in the set.
+ */
+static int list_cpus(cpu_set_t const *set, int *cpus)
+{
+    int ncpus = 0;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        if (CPU_ISSET(cpu, set))
+            cpus[ncpus++] = cpu;
+
+    return ncpus;
+}
+
+/**
+ * @brief Finds the processes of the node allowed on exactly the same cpus as
+ * this one (every one of them when the launcher does not bind processes).
+ *
+ * @param[in]   comm    Communicator.
+ * @param[in]   set     Allowed cpus of this process.
+ * @param[out]  slot    Position of this process among them.
+ * @param[out]  nslots  Number of them.
+ * @return On failure returns zero.
+ */
+static int shared_cpus(MPI_Comm comm, cpu_set_t const *set, int *slot, int *nslots)
+{
+    MPI_Comm node;
+    cpu_set_t *sets = NULL;
+    int rank, size, gather_ok;
+
+    if (MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node) != MPI_SUCCESS)
+        return 0;
+
+    gather_ok = MPI_Comm_rank(node, &rank) == MPI_SUCCESS && MPI_Comm_size(node, &size) == MPI_SUCCESS &&
+                (sets = malloc(size * sizeof *sets)) != NULL &&
+                MPI_Allgather(set, sizeof *set, MPI_BYTE, sets, sizeof *set, MPI_BYTE, node) == MPI_SUCCESS;
+    if (gather_ok)
+    {
+        *slot = *nslots = 0;
+        for (int other = 0; other < size; ++other)
+            if (CPU_EQUAL(&sets[other], set))
+            {
+                *slot += other < rank;
+                ++*nslots;
+            }
+    }
+
+    free(sets);
+    MPI_Comm_free(&node);
+
+    return gather_ok;
+}
+
+int knn_bind_threads(enum knn_bind bind, MPI_Comm comm)
+{
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE], ncpus, first, slot, nslots, bind_ok = 1;
+
+    if (bind == KNN_BIND_NONE)
+        return 1;
+
+    if (sched_getaffinity(0, sizeof allowed, &allowed) != 0 || !shared_cpus(comm, &allowed, &slot, &nslots))
+    {
+        fprintf(stderr, "Error: Could not get process affinity.\n");
+        return 0;
+    }
+
+    ncpus = list_cpus(&allowed, cpus);
+    if (ncpus < nslots)
+    {
+        fprintf(stderr, "Warning: %d processes share %d cpus, threads are not pinned.\n", nslots, ncpus);
+        return 1;
+    }
+
+    /* Processes sharing the same cpus split them, instead of all pinning to the first ones. */
+    first = (int)((long)slot * ncpus / nslots);
+    ncpus = (int)((long)(slot + 1) * ncpus / nslots) - first;
+
+#pragma omp parallel reduction(&& : bind_ok)
+    {
+        int thread = omp_get_thread_num(), nthreads = omp_get_num_threads(), cpu;
+        cpu_set_t set;
+
+        cpu = (bind == KNN_BIND_CLOSE) ? thread % ncpus : (int)((long)thread * ncpus / nthreads) % ncpus;
+
+        CPU_ZERO(&set);
+        CPU_SET(cpus[first + cpu], &set);
+        bind_ok = sched_setaffinity(0, sizeof set, &set) == 0;
+    }
+
+    if (!bind_ok)
+        fprintf(stderr, "Error: Could not pin threads.\n");
+
+    return bind_ok;
+}
+
+void knn_thread_placement(int nt, int *placement)
+{
+    assert(placement != NULL);
+
+    for (int n = 0; n < 2 * nt; ++n)
+        placement[n] = -1;
+
+#pragma omp parallel
+    {
+        int thread = omp_get_thread_num();
+        unsigned cpu, node;
+
+        if (thread < nt && getcpu(&cpu, &node) == 0)
+        {
+            placement[2 * thread] = (int)cpu;
+            placement[2 * thread + 1] = (int)node;
+        }
+    }
+}
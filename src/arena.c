@@ -0,0 +1,152 @@
+#define _DEFAULT_SOURCE
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+/**
+ * @brief Arena memory block.
+ */
+struct knn_arena_block
+{
+    struct knn_arena_block *next;
+    unsigned char *memory;
+    size_t size, offset;
+};
+
+static size_t align_up(size_t size, size_t alignment)
+{
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+/**
+ * @brief Allocates a new arena block.
+ *
+ * @param       size    Block size in bytes.
+ * @return On failure returns NULL.
+ */
+static struct knn_arena_block *create_block(size_t size)
+{
+    struct knn_arena_block *block;
+
+    block = malloc(sizeof *block);
+    if (block == NULL)
+        return NULL;
+
+    block->size = align_up(size, KNN_ARENA_PAGE);
+    block->offset = 0;
+    block->next = NULL;
+    block->memory = mmap(NULL, block->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block->memory == MAP_FAILED)
+    {
+        free(block);
+        return NULL;
+    }
+
+    return block;
+}
+
+static void destroy_blocks(struct knn_arena_block *block)
+{
+    struct knn_arena_block *next;
+
+    for (; block != NULL; block = next)
+    {
+        next = block->next;
+        munmap(block->memory, block->size);
+        free(block);
+    }
+}
+
+int knn_arena_init(knn_arena *arena, size_t capacity)
+{
+    assert(arena != NULL);
+
+    arena->head = NULL;
+    arena->capacity = 0;
+
+    if (capacity == 0)
+        return 1;
+
+    arena->head = create_block(capacity);
+    if (arena->head == NULL)
+    {
+        fprintf(stderr, "Error: Could not allocate arena.\n");
+        return 0;
+    }
+    arena->capacity = arena->head->size;
+
+    return 1;
+}
+
+void *knn_arena_alloc(knn_arena *arena, size_t size)
+{
+    return knn_arena_alloc_aligned(arena, size, KNN_ARENA_ALIGNMENT);
+}
+
+void *knn_arena_alloc_aligned(knn_arena *arena, size_t size, size_t alignment)
+{
+    struct knn_arena_block *block;
+    size_t offset, block_size;
+
+    assert(arena != NULL);
+    assert(alignment >= KNN_ARENA_ALIGNMENT && alignment <= KNN_ARENA_PAGE && (alignment & (alignment - 1)) == 0);
+
+    size = align_up(size != 0 ? size : 1, KNN_ARENA_ALIGNMENT);
+
+    /* Blocks are page aligned, so aligning offsets aligns addresses. */
+    block = arena->head;
+    if (block == NULL || block->size < size || block->size - size < align_up(block->offset, alignment))
+    {
+        block_size = (block != NULL) ? 2 * block->size : KNN_ARENA_MIN_BLOCK;
+        if (block_size < size)
+            block_size = size;
+
+        block = create_block(block_size);
+        if (block == NULL)
+        {
+            fprintf(stderr, "Error: Could not grow arena.\n");
+            return NULL;
+        }
+
+        block->next = arena->head;
+        arena->head = block;
+        arena->capacity += block->size;
+    }
+
+    offset = align_up(block->offset, alignment);
+    block->offset = offset + size;
+
+    return block->memory + offset;
+}
+
+void knn_arena_reset(knn_arena *arena)
+{
+    assert(arena != NULL);
+
+    if (arena->head == NULL)
+        return;
+
+    if (arena->head->next != NULL)
+    {
+        destroy_blocks(arena->head);
+        arena->head = create_block(arena->capacity);
+        arena->capacity = (arena->head != NULL) ? arena->head->size : 0;
+        return;
+    }
+
+    /* Drop the pages of the previous run, the next one places them again by first touch. */
+    if (arena->head->offset != 0)
+        madvise(arena->head->memory, align_up(arena->head->offset, KNN_ARENA_PAGE), MADV_DONTNEED);
+    arena->head->offset = 0;
+}
+
+void knn_arena_free(knn_arena *arena)
+{
+    assert(arena != NULL);
+
+    destroy_blocks(arena->head);
+    arena->head = NULL;
+    arena->capacity = 0;
+}
@@ -0,0 +1,210 @@
+#define _POSIX_C_SOURCE 200809L
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "checkpoint.h"
+
+/**
+ * @brief Block record header.
+ */
+struct record
+{
+    int first, count;
+};
+
+/**
+ * @brief Loads the records of an existing checkpoint.
+ *
+ * @param[inout]    file            Checkpoint file, positioned after the header.
+ * @param           k               Nearest Neighbors.
+ * @param           npredictions    Number of predictions.
+ * @param[out]      kn              Array of @p npredictions by @p k neighbors.
+ * @param[out]      done            Number of finished predictions.
+ * @return Offset right after the last complete record.
+ */
+static long load_records(FILE *file, int k, int npredictions, knn_neighbor *kn, int *done)
+{
+    struct record record;
+    long valid = ftell(file);
+
+    *done = 0;
+    while (fread(&record, sizeof record, 1, file) == 1)
+    {
+        if (record.first != *done || record.count <= 0 || record.count > npredictions - *done)
+            break;
+
+        if (fread(&kn[record.first * k], sizeof *kn, (size_t)record.count * k, file) != (size_t)record.count * k)
+            break;
+
+        *done += record.count;
+        valid = ftell(file);
+    }
+
+    return valid;
+}
+
+/**
+ * @brief Writer thread: writes queued blocks in order until closed.
+ *
+ * @param[inout]    arg     Checkpoint.
+ * @return NULL.
+ */
+static void *write_blocks(void *arg)
+{
+    knn_checkpoint *checkpoint = arg;
+    struct knn_checkpoint_block block;
+    struct record record;
+    int write_ok;
+
+    pthread_mutex_lock(&checkpoint->lock);
+    for (;;)
+    {
+        while (checkpoint->count == 0 && !checkpoint->closing)
+            pthread_cond_wait(&checkpoint->changed, &checkpoint->lock);
+
+        if (checkpoint->count == 0)
+            break;
+
+        block = checkpoint->queue[checkpoint->head];
+        pthread_mutex_unlock(&checkpoint->lock);
+
+        record = (struct record){.first = block.first, .count = block.count};
+        write_ok = fwrite(&record, sizeof record, 1, checkpoint->file) == 1 &&
+                   fwrite(block.kn, sizeof *block.kn, (size_t)block.count * checkpoint->k, checkpoint->file) == (size_t)block.count * checkpoint->k &&
+                   fflush(checkpoint->file) == 0 &&
+                   fsync(fileno(checkpoint->file)) == 0;
+
+        pthread_mutex_lock(&checkpoint->lock);
+        checkpoint->head = (checkpoint->head + 1) % KNN_CHECKPOINT_QUEUE;
+        checkpoint->count--;
+        checkpoint->failed |= !write_ok;
+        pthread_cond_broadcast(&checkpoint->changed);
+    }
+    pthread_mutex_unlock(&checkpoint->lock);
+
+    return NULL;
+}
+
+uint32_t knn_checkpoint_checksum(float const *data, int nrows)
+{
+    unsigned char const *bytes = (unsigned char const *)data;
+    uint32_t hash = 2166136261u;
+
+    assert(data != NULL);
+
+    for (size_t n = 0; n < (size_t)nrows * NHOURS * sizeof *data; ++n)
+        hash = (hash ^ bytes[n]) * 16777619u;
+
+    return hash;
+}
+
+int knn_checkpoint_open(knn_checkpoint *checkpoint, char const *filename, knn_checkpoint_header const *header, knn_neighbor *kn, int *done)
+{
+    knn_checkpoint_header stored;
+    long valid;
+
+    assert(checkpoint != NULL);
+    assert(filename != NULL);
+    assert(header != NULL);
+    assert(kn != NULL);
+    assert(done != NULL);
+
+    *done = 0;
+    checkpoint->file = fopen(filename, "r+b");
+    if (checkpoint->file == NULL)
+        checkpoint->file = fopen(filename, "w+b");
+    if (checkpoint->file == NULL)
+    {
+        fprintf(stderr, "Error: Could not open file \"%s\".\n", filename);
+        return 0;
+    }
+
+    /* A file shorter than its header was never synced past creation: start it over. */
+    valid = 0;
+    if (fread(&stored, sizeof stored, 1, checkpoint->file) == 1)
+    {
+        if (memcmp(&stored, header, sizeof stored) != 0)
+        {
+            fprintf(stderr, "Error: Checkpoint \"%s\" belongs to another run.\n", filename);
+            fclose(checkpoint->file);
+            return 0;
+        }
+
+        valid = load_records(checkpoint->file, header->k, header->npredictions, kn, done);
+    }
+
+    if (fflush(checkpoint->file) != 0 || ftruncate(fileno(checkpoint->file), valid) != 0 || fseek(checkpoint->file, valid, SEEK_SET) != 0 ||
+        (valid == 0 && fwrite(header, sizeof *header, 1, checkpoint->file) != 1) ||
+        fflush(checkpoint->file) != 0 || fsync(fileno(checkpoint->file)) != 0)
+    {
+        fprintf(stderr, "Error: Could not write checkpoint \"%s\".\n", filename);
+        fclose(checkpoint->file);
+        return 0;
+    }
+
+    checkpoint->k = header->k;
+    checkpoint->head = checkpoint->count = checkpoint->closing = checkpoint->failed = 0;
+    pthread_mutex_init(&checkpoint->lock, NULL);
+    pthread_cond_init(&checkpoint->changed, NULL);
+    if (pthread_create(&checkpoint->writer, NULL, write_blocks, checkpoint) != 0)
+    {
+        fprintf(stderr, "Error: Could not start checkpoint writer.\n");
+        pthread_cond_destroy(&checkpoint->changed);
+        pthread_mutex_destroy(&checkpoint->lock);
+        fclose(checkpoint->file);
+        return 0;
+    }
+
+    return 1;
+}
+
+int knn_checkpoint_write(knn_checkpoint *checkpoint, int first, int count, knn_neighbor const *kn)
+{
+    int write_ok;
+
+    assert(checkpoint != NULL);
+    assert(kn != NULL);
+
+    pthread_mutex_lock(&checkpoint->lock);
+    while (checkpoint->count == KNN_CHECKPOINT_QUEUE)
+        pthread_cond_wait(&checkpoint->changed, &checkpoint->lock);
+
+    checkpoint->queue[(checkpoint->head + checkpoint->count) % KNN_CHECKPOINT_QUEUE] = (struct knn_checkpoint_block){
+        .first = first,
+        .count = count,
+        .kn = kn};
+    checkpoint->count++;
+    write_ok = !checkpoint->failed;
+
+    pthread_cond_broadcast(&checkpoint->changed);
+    pthread_mutex_unlock(&checkpoint->lock);
+
+    return write_ok;
+}
+
+int knn_checkpoint_close(knn_checkpoint *checkpoint)
+{
+    int close_ok;
+
+    assert(checkpoint != NULL);
+
+    pthread_mutex_lock(&checkpoint->lock);
+    checkpoint->closing = 1;
+    pthread_cond_broadcast(&checkpoint->changed);
+    pthread_mutex_unlock(&checkpoint->lock);
+
+    pthread_join(checkpoint->writer, NULL);
+
+    close_ok = !checkpoint->failed;
+    if (fclose(checkpoint->file) != 0)
+        close_ok = 0;
+
+    pthread_cond_destroy(&checkpoint->changed);
+    pthread_mutex_destroy(&checkpoint->lock);
+
+    if (!close_ok)
+        fprintf(stderr, "Error: Could not write checkpoint.\n");
+
+    return close_ok;
+}
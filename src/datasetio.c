@@ -86,6 +86,7 @@ int knn_load_dataset(char const *filename, int *ndays, float **data)
     if (!header_ok)
     {
         fprintf(stderr, "Error: Corrupted header in file \"%s\".\n", filename);
+        fclose(file);
         return 0;
     }
 
@@ -93,6 +94,7 @@ int knn_load_dataset(char const *filename, int *ndays, float **data)
     if (!body_ok)
     {
         fprintf(stderr, "Error: Corrupted body in file \"%s\".\n", filename);
+        fclose(file);
         return 0;
     }
 
@@ -100,7 +102,33 @@ int knn_load_dataset(char const *filename, int *ndays, float **data)
     return 1;
 }
 
-int knn_save_predictions(char const *filename, float *predictions)
+int knn_load_weights(char const *filename, float *weights)
+{
+    FILE *file;
+
+    assert(filename != NULL);
+    assert(weights != NULL);
+
+    file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error: Could not open file \"%s\".\n", filename);
+        return 0;
+    }
+
+    for (int nhour = 0; nhour < NHOURS; ++nhour)
+        if (fscanf(file, "%f%*[, \t\r\n]", &weights[nhour]) < 1)
+        {
+            fprintf(stderr, "Error: Corrupted weights in file \"%s\".\n", filename);
+            fclose(file);
+            return 0;
+        }
+
+    fclose(file);
+    return 1;
+}
+
+int knn_save_predictions(char const *filename, int npredictions, float *predictions)
 {
     FILE *file = fopen(filename, "w");
     if (file == NULL)
@@ -109,7 +137,7 @@ int knn_save_predictions(char const *filename, float *predictions)
         return 0;
     }
 
-    for (int nprediction = 0; nprediction < NPREDICTIONS; ++nprediction)
+    for (int nprediction = 0; nprediction < npredictions; ++nprediction)
     {
         for (int nhour = 0; nhour < NHOURS - 1; ++nhour)
             fprintf(file, "%.1f,", predictions[nhour + nprediction * NHOURS]);
@@ -120,7 +148,7 @@ int knn_save_predictions(char const *filename, float *predictions)
     return 1;
 }
 
-int knn_save_mape(char const *filename, float *mape)
+int knn_save_mape(char const *filename, int npredictions, float *mape)
 {
     FILE *file = fopen(filename, "w");
     if (file == NULL)
@@ -129,7 +157,7 @@ int knn_save_mape(char const *filename, float *mape)
         return 0;
     }
 
-    for (int nprediction = 0; nprediction < NPREDICTIONS; ++nprediction)
+    for (int nprediction = 0; nprediction < npredictions; ++nprediction)
         fprintf(file, "%.1f\n", mape[nprediction]);
 
     fclose(file);
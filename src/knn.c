@@ -1,25 +1,62 @@
 #include <assert.h>
+#include <omp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
 #include "knn.h"
 
-static float calculate_distance(float const *neighbor, float const *target)
+/*
+ * Row distances. All of them share one signature so the kernels can be
+ * specialized on them; each only reads what its metric needs.
+ */
+
+static inline float distance_l1(knn_metric const *metric, float const *neighbor, knn_row_stats const *neighbor_stats, float const *target, knn_row_stats const *target_stats)
+{
+    float total_distance = 0.0f;
+
+    for (int hour = 0; hour < NHOURS; hour++)
+        total_distance += fabsf(neighbor[hour] - target[hour]);
+
+    return total_distance;
+}
+
+static inline float distance_l2(knn_metric const *metric, float const *neighbor, knn_row_stats const *neighbor_stats, float const *target, knn_row_stats const *target_stats)
+{
+    float total_distance = 0.0f, dif;
+
+    for (int hour = 0; hour < NHOURS; hour++)
+        dif = neighbor[hour] - target[hour], total_distance += dif * dif;
+
+    return total_distance;
+}
+
+static inline float distance_wl1(knn_metric const *metric, float const *neighbor, knn_row_stats const *neighbor_stats, float const *target, knn_row_stats const *target_stats)
 {
-    float total_distance = 0.0;
+    float total_distance = 0.0f;
 
     for (int hour = 0; hour < NHOURS; hour++)
-        total_distance += fabs(neighbor[hour] - target[hour]);
+        total_distance += metric->weights[hour] * fabsf(neighbor[hour] - target[hour]);
 
     return total_distance;
 }
 
-static void initialize_array(int k, float const *target, float const *data, knn_neighbor *nk)
+static inline float distance_corr(knn_metric const *metric, float const *neighbor, knn_row_stats const *neighbor_stats, float const *target, knn_row_stats const *target_stats)
+{
+    float covariance = 0.0f;
+
+    for (int hour = 0; hour < NHOURS; hour++)
+        covariance += (neighbor[hour] - neighbor_stats->mean) * (target[hour] - target_stats->mean);
+
+    return 1.0f - covariance * neighbor_stats->scale * target_stats->scale;
+}
+
+static void initialize_array(int k, knn_neighbor *nk)
 {
     for (int n = 0; n < k; ++n)
         nk[n] = (knn_neighbor){
-            .eval = calculate_distance(&data[n * NHOURS], target),
-            .index = n};
+            .eval = INFINITY,
+            .index = KNN_NO_NEIGHBOR};
 }
 
 static void swap_neighbor(knn_neighbor *a, knn_neighbor *b)
@@ -28,6 +65,15 @@ static void swap_neighbor(knn_neighbor *a, knn_neighbor *b)
     tmp = *a, *a = *b, *b = tmp;
 }
 
+/**
+ * @brief Neighbor order: by eval, ties by index. Being total, the k nearest
+ * do not depend on how candidates are split between threads and processes.
+ */
+static inline int precedes(float eval, int index, knn_neighbor const *neighbor)
+{
+    return eval < neighbor->eval || (eval == neighbor->eval && index < neighbor->index);
+}
+
 void knn_bubble_sort_array(int k, knn_neighbor *nk, int asc)
 {
     int nswaps;
@@ -36,7 +82,7 @@ void knn_bubble_sort_array(int k, knn_neighbor *nk, int asc)
     {
         nswaps = 0;
         for (int n = 0; n < k - 1; ++n)
-            if (!(nk[n].eval <= nk[n + 1].eval) && asc)
+            if (asc && precedes(nk[n + 1].eval, nk[n + 1].index, &nk[n]))
                 swap_neighbor(&nk[n], &nk[n + 1]), ++nswaps;
     } while (nswaps != 0);
 }
@@ -44,24 +90,18 @@ void knn_bubble_sort_array(int k, knn_neighbor *nk, int asc)
 static void sink_first(int k, knn_neighbor *nk)
 {
     int n = 0;
-    while (nk[n].eval < nk[n + 1].eval && n < k - 1)
+    while (n < k - 1 && precedes(nk[n].eval, nk[n].index, &nk[n + 1]))
         swap_neighbor(&nk[n], &nk[n + 1]), ++n;
 }
 
-static void find_k(int k, float const *target, float const *data, int size, knn_neighbor *kn)
+static void push_neighbor(int k, knn_neighbor *kn, float dst, int index)
 {
-    float dst;
-    for (int n = k; n < size; ++n)
+    if (precedes(dst, index, &kn[0]))
     {
-        dst = calculate_distance(&data[n * NHOURS], target);
-
-        if (dst < kn[0].eval)
-        {
-            kn[0] = (knn_neighbor){
-                .eval = dst,
-                .index = n};
-            sink_first(k, kn);
-        }
+        kn[0] = (knn_neighbor){
+            .eval = dst,
+            .index = index};
+        sink_first(k, kn);
     }
 }
 
@@ -79,20 +119,267 @@ static float calculate_mape(int ndays, float *data, float *prediction, int data_
     return mape;
 }
 
-void knn_kNN(int k, float const *target, float const *data, int size, knn_neighbor *nk)
+int knn_parse_metric(char const *name, enum knn_metric_kind *kind)
+{
+    assert(name != NULL);
+    assert(kind != NULL);
+
+    if (strcmp(name, "l1") == 0)
+        *kind = KNN_METRIC_L1;
+    else if (strcmp(name, "l2") == 0)
+        *kind = KNN_METRIC_L2;
+    else if (strcmp(name, "wl1") == 0)
+        *kind = KNN_METRIC_WL1;
+    else if (strcmp(name, "corr") == 0)
+        *kind = KNN_METRIC_CORR;
+    else
+        return 0;
+
+    return 1;
+}
+
+void knn_row_stats_compute(knn_metric const *metric, float const *rows, int nrows, knn_row_stats *stats)
+{
+    assert(metric != NULL);
+    assert(rows != NULL);
+    assert(stats != NULL);
+
+    if (metric->kind != KNN_METRIC_CORR)
+        return;
+
+#pragma omp parallel for
+    for (int n = 0; n < nrows; ++n)
+    {
+        float mean = 0.0f, variance = 0.0f;
+
+        for (int hour = 0; hour < NHOURS; hour++)
+            mean += rows[n * NHOURS + hour];
+        mean /= NHOURS;
+
+        for (int hour = 0; hour < NHOURS; hour++)
+            variance += (rows[n * NHOURS + hour] - mean) * (rows[n * NHOURS + hour] - mean);
+
+        stats[n] = (knn_row_stats){
+            .mean = mean,
+            .scale = (variance > 0.0f) ? 1.0f / sqrtf(variance) : 0.0f};
+    }
+}
+
+/**
+ * @brief Rows per tile: @p size split in @c KNN_THREAD_TILES per thread,
+ * rounded down to whole pages and clamped to [@c KNN_TILE_MIN_ROWS , @c KNN_TILE_ROWS ].
+ *
+ * @param   size        Data row count.
+ * @param   nthreads    Number of threads.
+ * @return Tile rows.
+ */
+static int tile_rows_for(int size, int nthreads)
+{
+    int rows = size / (nthreads * KNN_THREAD_TILES) / KNN_TILE_MIN_ROWS * KNN_TILE_MIN_ROWS;
+
+    if (rows < KNN_TILE_MIN_ROWS)
+        return KNN_TILE_MIN_ROWS;
+
+    return (rows > KNN_TILE_ROWS) ? KNN_TILE_ROWS : rows;
+}
+
+/**
+ * @brief Targets per group. Threads scan (target group, tile) pairs
+ * round-robin: with @c KNN_THREAD_TILES tiles per thread a single group
+ * makes every thread scan the tiles it owns. With fewer, too few to even out
+ * between threads (and small enough to stay in cache), blocks of
+ * @c KNN_TARGET_TILE targets spread the pairs over every thread.
+ *
+ * @param   ntargets    Number of targets.
+ * @param   ntiles      Number of tiles.
+ * @param   nthreads    Number of threads.
+ * @return Group size, at least one.
+ */
+static int target_group_size(int ntargets, int ntiles, int nthreads)
+{
+    if (ntiles < nthreads * KNN_THREAD_TILES && ntargets > KNN_TARGET_TILE)
+        return KNN_TARGET_TILE;
+
+    return (ntargets > 0) ? ntargets : 1;
+}
+
+void knn_first_touch(float *data, int size)
 {
-    assert(k > 0);
-    assert(target != NULL);
     assert(data != NULL);
-    assert(size > 0);
-    assert(nk != NULL);
 
-    initialize_array(k, target, data, nk);
-    knn_bubble_sort_array(k, nk, 0);
-    find_k(k, target, data, size, nk);
+#pragma omp parallel
+    {
+        int nthreads = omp_get_num_threads(), tile_rows = tile_rows_for(size, nthreads), ntiles = (size + tile_rows - 1) / tile_rows, rows;
+
+        for (int tile = omp_get_thread_num(); tile < ntiles; tile += nthreads)
+        {
+            rows = (size - tile * tile_rows < tile_rows) ? size - tile * tile_rows : tile_rows;
+            memset(&data[tile * tile_rows * NHOURS], 0, rows * NHOURS * sizeof *data);
+        }
+    }
+}
+
+/**
+ * @brief Sorted list being merged: its next neighbor, the step to the one
+ * after it and how many are left.
+ */
+struct merge_list
+{
+    knn_neighbor const *next;
+    int step, left;
+};
+
+static void sift_down(struct merge_list *heap, int size, int n)
+{
+    struct merge_list tmp;
+    int child;
+
+    while ((child = 2 * n + 1) < size)
+    {
+        if (child + 1 < size && precedes(heap[child + 1].next->eval, heap[child + 1].next->index, heap[child].next))
+            ++child;
+        if (!precedes(heap[child].next->eval, heap[child].next->index, heap[n].next))
+            break;
+
+        tmp = heap[n], heap[n] = heap[child], heap[child] = tmp;
+        n = child;
+    }
+}
+
+void knn_merge_neighbors(int k, int nlists, knn_neighbor const *lists, size_t stride, int asc, knn_neighbor *kn)
+{
+    struct merge_list heap[nlists];
+    int size = nlists;
+
+    assert(k > 0);
+    assert(nlists > 0);
+    assert(lists != NULL);
+    assert(kn != NULL);
+
+    for (int list = 0; list < nlists; ++list)
+        heap[list] = (struct merge_list){
+            .next = &lists[list * stride + (asc ? 0 : k - 1)],
+            .step = asc ? 1 : -1,
+            .left = k};
+
+    for (int n = size / 2 - 1; n >= 0; --n)
+        sift_down(heap, size, n);
+
+    for (int n = 0; n < k; ++n)
+    {
+        kn[n] = *heap[0].next;
+        if (--heap[0].left == 0)
+            heap[0] = heap[--size];
+        else
+            heap[0].next += heap[0].step;
+        sift_down(heap, size, 0);
+    }
+}
+
+/**
+ * @brief Merges per thread candidates into the k-Nearest Neighbors of every
+ * target. Must be called by the whole OpenMP team.
+ *
+ * @param           k           Nearest Neighbors.
+ * @param           ntargets    Number of targets.
+ * @param           nthreads    Number of threads.
+ * @param[in]       scratch     Per thread candidates of every target, worst first.
+ * @param[out]      kn          Array of @p ntargets by @p k ascending neighbors.
+ */
+static void merge_candidates(int k, int ntargets, int nthreads, knn_neighbor const *scratch, knn_neighbor *kn)
+{
+#pragma omp for
+    for (int target = 0; target < ntargets; ++target)
+        knn_merge_neighbors(k, nthreads, &scratch[target * k], (size_t)ntargets * k, 0, &kn[target * k]);
+}
+
+#define KERNEL_SUFFIX l1
+#define KERNEL_DISTANCE distance_l1
+#include "knn_kernels.inc"
+#undef KERNEL_DISTANCE
+#undef KERNEL_SUFFIX
+
+#define KERNEL_SUFFIX l2
+#define KERNEL_DISTANCE distance_l2
+#include "knn_kernels.inc"
+#undef KERNEL_DISTANCE
+#undef KERNEL_SUFFIX
+
+#define KERNEL_SUFFIX wl1
+#define KERNEL_DISTANCE distance_wl1
+#include "knn_kernels.inc"
+#undef KERNEL_DISTANCE
+#undef KERNEL_SUFFIX
+
+#define KERNEL_SUFFIX corr
+#define KERNEL_DISTANCE distance_corr
+#include "knn_kernels.inc"
+#undef KERNEL_DISTANCE
+#undef KERNEL_SUFFIX
+
+size_t knn_kNN_window_workspace(int window)
+{
+    size_t size = KNN_TILE_ROWS * sizeof(double) + (size_t)(window + 1) * (KNN_TILE_ROWS + window - 1) * sizeof(float);
+    return (size + KNN_WORKSPACE_ALIGNMENT - 1) / KNN_WORKSPACE_ALIGNMENT * KNN_WORKSPACE_ALIGNMENT;
+}
+
+void knn_kNN_batch(int k, knn_metric const *metric, int ntargets, float const *targets, knn_row_stats const *target_stats, int targets_day,
+                   float const *data, knn_row_stats const *data_stats, int data_day, int size, knn_neighbor *scratch, knn_neighbor *kn)
+{
+    assert(k > 0);
+    assert(metric != NULL);
+    assert(targets != NULL && target_stats != NULL);
+    assert(data != NULL && data_stats != NULL);
+    assert(scratch != NULL);
+    assert(kn != NULL);
+
+    switch (metric->kind)
+    {
+    case KNN_METRIC_L1:
+        kNN_batch_l1(k, metric, ntargets, targets, target_stats, targets_day, data, data_stats, data_day, size, scratch, kn);
+        break;
+    case KNN_METRIC_L2:
+        kNN_batch_l2(k, metric, ntargets, targets, target_stats, targets_day, data, data_stats, data_day, size, scratch, kn);
+        break;
+    case KNN_METRIC_WL1:
+        kNN_batch_wl1(k, metric, ntargets, targets, target_stats, targets_day, data, data_stats, data_day, size, scratch, kn);
+        break;
+    case KNN_METRIC_CORR:
+        kNN_batch_corr(k, metric, ntargets, targets, target_stats, targets_day, data, data_stats, data_day, size, scratch, kn);
+        break;
+    }
+}
+
+void knn_kNN_window(int k, knn_metric const *metric, int window, int ntargets, float const *targets, knn_row_stats const *target_stats, int targets_day,
+                    float const *data, knn_row_stats const *data_stats, int data_day, int size, knn_neighbor *scratch, void *workspace, knn_neighbor *kn)
+{
+    assert(k > 0);
+    assert(metric != NULL);
+    assert(window > 0);
+    assert(targets != NULL && target_stats != NULL);
+    assert(data != NULL && data_stats != NULL);
+    assert(scratch != NULL);
+    assert(workspace != NULL);
+    assert(kn != NULL);
+
+    switch (metric->kind)
+    {
+    case KNN_METRIC_L1:
+        kNN_window_l1(k, metric, window, ntargets, targets, target_stats, targets_day, data, data_stats, data_day, size, scratch, workspace, kn);
+        break;
+    case KNN_METRIC_L2:
+        kNN_window_l2(k, metric, window, ntargets, targets, target_stats, targets_day, data, data_stats, data_day, size, scratch, workspace, kn);
+        break;
+    case KNN_METRIC_WL1:
+        kNN_window_wl1(k, metric, window, ntargets, targets, target_stats, targets_day, data, data_stats, data_day, size, scratch, workspace, kn);
+        break;
+    case KNN_METRIC_CORR:
+        kNN_window_corr(k, metric, window, ntargets, targets, target_stats, targets_day, data, data_stats, data_day, size, scratch, workspace, kn);
+        break;
+    }
 }
 
-static void compute_prediction_and_mape(int k, int ndays, float const *data, int n, knn_neighbor const *neighbors, float *prediction, float *mape)
+static void compute_prediction_and_mape(int k, float const *data, int day, knn_neighbor const *neighbors, float *prediction, float *mape)
 {
     *mape = 0.0;
     for (int nhour = 0; nhour < NHOURS; ++nhour)
@@ -101,13 +388,13 @@ static void compute_prediction_and_mape(int k, int ndays, float const *data, int
         for (int neighbor = 0; neighbor < k; ++neighbor)
             prediction[nhour] += data[nhour + NHOURS * neighbors[neighbor].index] / k;
 
-        *mape += (100.0 / NHOURS) * fabs(data[nhour + (ndays - NPREDICTIONS + n) * NHOURS] - prediction[nhour]) / data[nhour + (ndays - NPREDICTIONS + n) * NHOURS];
+        *mape += (100.0 / NHOURS) * fabs(data[nhour + day * NHOURS] - prediction[nhour]) / data[nhour + day * NHOURS];
     }
 }
 
-void knn_predictions(int k, int ndays, knn_neighbor const *neighbors, float const *data, float *predictions, float *mape)
+void knn_predictions(int k, int first, int npredictions, knn_neighbor const *neighbors, float const *data, float *predictions, float *mape)
 {
 #pragma omp parallel for
-    for (int prediction = 0; prediction < NPREDICTIONS; ++prediction)
-        compute_prediction_and_mape(k, ndays, data, prediction, &neighbors[prediction * k], &predictions[prediction * NHOURS], &mape[prediction]);
+    for (int prediction = 0; prediction < npredictions; ++prediction)
+        compute_prediction_and_mape(k, data, first + prediction, &neighbors[prediction * k], &predictions[prediction * NHOURS], &mape[prediction]);
 }
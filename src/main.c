@@ -2,6 +2,10 @@
 #include <omp.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include "affinity.h"
+#include "arena.h"
+#include "checkpoint.h"
 #include "datasetio.h"
 #include "knn.h"
 
@@ -22,11 +26,70 @@ struct knn_args
 {
     char const *filename;
     int k, np, nt;
+    enum knn_bind bind;
+    int backtest, backtest_from, backtest_to;
+    int window;
+    enum knn_metric_kind metric;
+    char const *weights;
+    char const *checkpoint;
+    int checkpoint_every;
+    int repeat;
 };
 
+/**
+ * @brief Parses an optional @c --name=value argument.
+ *
+ * @param[in]   arg     Argument.
+ * @param[out]  args    Arguments.
+ * @return On failure returns zero.
+ */
+static int parse_option(char const *arg, struct knn_args *args)
+{
+    if (strncmp(arg, "--bind=", 7) == 0)
+        return knn_parse_bind(arg + 7, &args->bind);
+
+    if (strncmp(arg, "--window=", 9) == 0)
+        return (args->window = strtol(arg + 9, NULL, 10)) > 0;
+
+    if (strncmp(arg, "--metric=", 9) == 0)
+        return knn_parse_metric(arg + 9, &args->metric);
+
+    if (strncmp(arg, "--weights=", 10) == 0)
+        return (args->weights = arg + 10)[0] != '\0';
+
+    if (strncmp(arg, "--checkpoint=", 13) == 0)
+        return (args->checkpoint = arg + 13)[0] != '\0';
+
+    if (strncmp(arg, "--checkpoint-every=", 19) == 0)
+        return (args->checkpoint_every = strtol(arg + 19, NULL, 10)) > 0;
+
+    if (strncmp(arg, "--repeat=", 9) == 0)
+        return (args->repeat = strtol(arg + 9, NULL, 10)) > 0;
+
+    if (strcmp(arg, "--backtest") == 0)
+        return args->backtest = 1;
+
+    if (strncmp(arg, "--backtest=", 11) == 0)
+        return (args->backtest = sscanf(arg + 11, "%d:%d", &args->backtest_from, &args->backtest_to) == 2) &&
+               args->backtest_from >= 0 && (args->backtest_to == 0 || args->backtest_to > args->backtest_from);
+
+    return 0;
+}
+
 /**
  * @brief Parses arguments.
  *
+ * Usage: k filename nt [--bind=none|close|spread] [--backtest[=FROM:TO]] [--window=D]
+ *        [--metric=l1|l2|wl1|corr] [--weights=FILE] [--checkpoint=FILE] [--checkpoint-every=N]
+ *        [--repeat=R]
+ *
+ * A backtest predicts every day in [FROM, TO) (the whole history by default,
+ * TO zero meaning the last day) from the days strictly before it. A window
+ * compares the D days ending at each day instead of the day alone. wl1
+ * weights are read from FILE (all ones by default). A checkpoint records
+ * every N finished predictions and lets a restarted run skip them. The
+ * whole run is repeated R times (once by default) reusing its memory.
+ *
  * @param       argc Argument count.
  * @param[in]   argv Argument vector.
  * @param[out]  args Arguments.
@@ -34,7 +97,7 @@ struct knn_args
  */
 static int init(int argc, char **argv, struct knn_args *args)
 {
-    if (argc != 4)
+    if (argc < 4)
     {
         fprintf(stderr, ERROR_MSG "Insufficent arguments.\n");
         return 0;
@@ -43,8 +106,91 @@ static int init(int argc, char **argv, struct knn_args *args)
     args->filename = argv[2];
     args->k = strtol(argv[1], NULL, 10);
     args->nt = strtol(argv[3], NULL, 10);
+    args->bind = KNN_BIND_NONE;
+    args->backtest = args->backtest_from = args->backtest_to = 0;
+    args->window = 1;
+    args->metric = KNN_METRIC_L1;
+    args->weights = NULL;
+    args->checkpoint = NULL;
+    args->checkpoint_every = 0;
+    args->repeat = 1;
+
+    if (args->k < 1 || args->nt < 1)
+    {
+        fprintf(stderr, ERROR_MSG "k and nt must be positive.\n");
+        return 0;
+    }
+
+    for (int narg = 4; narg < argc; ++narg)
+        if (!parse_option(argv[narg], args))
+        {
+            fprintf(stderr, ERROR_MSG "Invalid argument \"%s\".\n", argv[narg]);
+            return 0;
+        }
+
+    if (args->weights != NULL && args->metric != KNN_METRIC_WL1)
+    {
+        fprintf(stderr, ERROR_MSG "--weights needs --metric=wl1.\n");
+        return 0;
+    }
+
+    if (args->checkpoint_every != 0 && args->checkpoint == NULL)
+    {
+        fprintf(stderr, ERROR_MSG "--checkpoint-every needs --checkpoint.\n");
+        return 0;
+    }
+
+    if (args->checkpoint_every == 0)
+        args->checkpoint_every = KNN_CHECKPOINT_BLOCK;
 
-    return 3;
+    return argc - 1;
+}
+
+/**
+ * @brief Gathers and prints the thread placement of every process.
+ *
+ * @param       pid     Process id.
+ * @param       np      Number of processes.
+ * @param       nt      Number of threads.
+ * @return On failure returns zero.
+ */
+static int report_affinity(int pid, int np, int nt)
+{
+    int placement[2 * nt], *placements = NULL, gather_ok;
+
+    knn_thread_placement(nt, placement);
+
+    if (pid == 0)
+    {
+        placements = malloc(2 * nt * np * sizeof *placements);
+        if (placements == NULL)
+        {
+            fprintf(stderr, "%d:" ERROR_MSG "Affinity report error.\n", pid);
+            return 0;
+        }
+    }
+
+    gather_ok = MPI_Gather(placement, 2 * nt, MPI_INT, placements, 2 * nt, MPI_INT, 0, MPI_COMM_WORLD);
+    if (pid == 0)
+    {
+        if (gather_ok == MPI_SUCCESS)
+            for (int rank = 0; rank < np; ++rank)
+            {
+                printf("Rank \e[1m%d\e[22m affinity:", rank);
+                for (int thread = 0; thread < nt; ++thread)
+                    printf(" %d:cpu%d/node%d", thread, placements[2 * (rank * nt + thread)], placements[2 * (rank * nt + thread) + 1]);
+                printf("\n");
+            }
+        free(placements);
+    }
+
+    if (gather_ok != MPI_SUCCESS)
+    {
+        fprintf(stderr, "%d:" ERROR_MSG "Affinity gather error.\n", pid);
+        return 0;
+    }
+
+    return 1;
 }
 
 /**
@@ -107,97 +253,211 @@ static int broadcast_ndays(int pid, int *ndays)
 }
 
 /**
- * @brief Calculates chunk size for master and slaves based on total and np;
+ * @brief Sets up the distance metric, broadcasting the weights of the master.
+ *
+ * @param       pid     Process id.
+ * @param[in]   args    Arguments.
+ * @param[out]  metric  Distance metric.
+ * @return On failure returns zero.
+ */
+static int setup_metric(int pid, struct knn_args const *args, knn_metric *metric)
+{
+    int load_ok = 1;
+
+    metric->kind = args->metric;
+    for (int nhour = 0; nhour < NHOURS; ++nhour)
+        metric->weights[nhour] = 1.0f;
+
+    if (args->weights == NULL)
+        return 1;
+
+    if (pid == 0)
+    {
+        printf("Loading weights...");
+        load_ok = knn_load_weights(args->weights, metric->weights);
+        printf(load_ok ? DONE_MSG : FAILED_MSG);
+    }
+
+    if (MPI_Bcast(&load_ok, 1, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS || !load_ok ||
+        MPI_Bcast(metric->weights, NHOURS, MPI_FLOAT, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
+    {
+        fprintf(stderr, "%d:" ERROR_MSG "Weights setup error.\n", pid);
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Computes the statistics of @p nrows rows and their @p halo rows.
  *
- * @param       total               Total of data to analize.
- * @param       np                  Number of processes.
- * @param[out]  master_chunk_size   Master chunk size.
- * @param[out]  slaves_chunk_size   Slaves chunk size.
+ * @param[inout]    arena   Pipeline arena.
+ * @param           pid     Process id.
+ * @param[in]       metric  Distance metric.
+ * @param           halo    Halo rows.
+ * @param[in]       rows    Matrix of @p nrows by @c NHOURS after its halo.
+ * @param           nrows   Row count.
+ * @param[out]      stats   Statistics of the rows, halo ones before them.
+ * @return On failure returns zero.
  */
-static void calculate_chunk_size(int total, int np, int *master_size, int *slaves_size)
+static int compute_row_stats(knn_arena *arena, int pid, knn_metric const *metric, int halo, float const *rows, int nrows, knn_row_stats **stats)
 {
-    *master_size = total / np + total % np;
-    *slaves_size = total / np;
+    knn_row_stats *buffer;
+
+    buffer = knn_arena_alloc(arena, (halo + nrows) * sizeof *buffer);
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "%d:" ERROR_MSG "Row statistics error.\n", pid);
+        return 0;
+    }
+
+    knn_row_stats_compute(metric, &rows[-halo * NHOURS], halo + nrows, buffer);
+    *stats = &buffer[halo];
+
+    return 1;
 }
 
 /**
- * @brief Calculates the starting index of a chunk of a process
+ * @brief Calculates the chunk bounds of every process, splitting the search
+ * work evenly rather than the days.
+ *
+ * A day is compared with every predicted day after it: in a backtest early
+ * days are compared with almost every prediction and late ones with a few,
+ * so early chunks get fewer days. By default every day is compared with
+ * every prediction and chunks are even.
  *
- * @param       pid             Process id.
  * @param       np              Number of processes.
- * @param       master_size     Master chunk size.
- * @param       slaves_size     Slave chunk size.
- * @param[out]  chunk_start     Chunk start.
+ * @param       first           First predicted day.
+ * @param       npredictions    Number of predictions.
+ * @param       ncandidates     Number of days to chunk.
+ * @param[out]  bounds          Array of @p np + 1 bounds, chunk of process p is [bounds[p], bounds[p + 1]).
+ */
+static void calculate_chunk_bounds(int np, int first, int npredictions, int ncandidates, int *bounds)
+{
+    long long total = 0, work = 0;
+    int rank = 1;
+
+#define DAY_WORK(DAY) (first + npredictions - (((DAY) + 1 > first) ? (DAY) + 1 : first))
+
+    for (int day = 0; day < ncandidates; ++day)
+        total += DAY_WORK(day);
+
+    bounds[0] = 0;
+    for (int day = 0; day < ncandidates && rank < np; ++day)
+    {
+        work += DAY_WORK(day);
+        while (rank < np && work * np >= total * rank)
+            bounds[rank++] = day + 1;
+    }
+    while (rank <= np)
+        bounds[rank++] = ncandidates;
+
+#undef DAY_WORK
+}
+
+/**
+ * @brief Allocates chunk data with @p halo zeroed rows before it.
+ *
+ * Chunk rows start a page (the halo ends right before it), so every tile
+ * owns whole pages and the halo zeroing does not place any of them.
+ *
+ * @param[inout]    arena       Pipeline arena.
+ * @param           halo        Halo rows.
+ * @param           chunk_size  Chunk size.
+ * @return On failure returns NULL.
  */
-static void calculate_chunk_start(int pid, int np, int master_size, int slaves_size, int *chunk_start)
+static float *allocate_chunk_data(knn_arena *arena, int halo, int chunk_size)
 {
-    *chunk_start = (pid == 0) ? 0 : master_size + (pid - 1) * slaves_size;
+    size_t halo_size = NHOURS * halo * sizeof(float), padding;
+    unsigned char *buffer;
+
+    padding = (halo_size + KNN_ARENA_PAGE - 1) / KNN_ARENA_PAGE * KNN_ARENA_PAGE;
+    buffer = knn_arena_alloc_aligned(arena, padding + NHOURS * chunk_size * sizeof(float), KNN_ARENA_PAGE);
+    if (buffer == NULL)
+        return NULL;
+
+    memset(buffer + padding - halo_size, 0, halo_size);
+    return (float *)(buffer + padding);
 }
 
 /**
  * @brief Initialize necessary chunk metadata.
  *
- * @param       pid                 Process id.
- * @param       np                  Number of processes.
- * @param       chunk_ndays         Number of dataset days to chunk.
- * @param[out]  chunk_size          Current chunk size.
- * @param[out]  chunk_data          Current data.
- * @param[out]  chunk_counts        Current counts.
- * @param[out]  chunk_displs        Current displacements.
+ * @param[inout]    arena               Pipeline arena.
+ * @param           pid                 Process id.
+ * @param           np                  Number of processes.
+ * @param           first               First predicted day.
+ * @param           npredictions        Number of predictions.
+ * @param           chunk_ndays         Number of dataset days to chunk.
+ * @param           halo                Rows readable before every chunk.
+ * @param[out]      chunk_start         Current chunk start.
+ * @param[out]      chunk_size          Current chunk size.
+ * @param[out]      chunk_data          Current data.
+ * @param[out]      chunk_counts        Current counts.
+ * @param[out]      chunk_displs        Current displacements.
  * @return On failure returns zero.
  */
-static int initialize_chunk_metadata(int pid, int np, int chunk_ndays, int *chunk_size, float **chunk_data, int **chunk_counts, int **chunk_displs)
+static int initialize_chunk_metadata(knn_arena *arena, int pid, int np, int first, int npredictions, int chunk_ndays, int halo,
+                                     int *chunk_start, int *chunk_size, float **chunk_data, int **chunk_counts, int **chunk_displs)
 {
-    int master_chunk_size, slaves_chunk_size, n;
+    int *bounds, n;
 
-    calculate_chunk_size(chunk_ndays, np, &master_chunk_size, &slaves_chunk_size);
-    if (pid == 0)
+    bounds = knn_arena_alloc(arena, (np + 1) * sizeof *bounds);
+    if (bounds == NULL)
     {
-        printf("Initializing chunk metadata...");
-        *chunk_size = master_chunk_size;
-        *chunk_data = malloc(NHOURS * *chunk_size * sizeof **chunk_data);
-        if (*chunk_data == NULL)
+        fprintf(stderr, "%d:" ERROR_MSG "Chunk bounds error.\n", pid);
+        return 0;
+    }
+
+    calculate_chunk_bounds(np, first, npredictions, chunk_ndays, bounds);
+    for (n = 0; n < np - 1; ++n)
+        if (bounds[n + 1] - bounds[n] < halo)
         {
-            fprintf(stderr, FAILED_MSG "%d:" ERROR_MSG "Chunk data error.\n", pid);
+            fprintf(stderr, "%d:" ERROR_MSG "Chunks smaller than their %d halo rows.\n", pid, halo);
             return 0;
         }
 
-        *chunk_counts = malloc(np * sizeof **chunk_counts);
+    if (pid == 0)
+    {
+        printf("Initializing chunk metadata...");
+        *chunk_counts = knn_arena_alloc(arena, np * sizeof **chunk_counts);
         if (*chunk_counts == NULL)
         {
             fprintf(stderr, FAILED_MSG "%d:" ERROR_MSG "Chunk counts error.\n", pid);
             return 0;
         }
 
-        *chunk_displs = malloc(np * sizeof **chunk_displs);
+        *chunk_displs = knn_arena_alloc(arena, np * sizeof **chunk_displs);
         if (*chunk_displs == NULL)
         {
             fprintf(stderr, FAILED_MSG "%d:" ERROR_MSG "Chunk displs error.\n", pid);
             return 0;
         }
 
-        (*chunk_counts)[0] = NHOURS * master_chunk_size;
-        for (n = 1; n < np; ++n)
-            (*chunk_counts)[n] = NHOURS * slaves_chunk_size;
-
-        (*chunk_displs)[0] = 0;
-        for (n = 1; n < np; ++n)
-            (*chunk_displs)[n] = (*chunk_displs)[n - 1] + (*chunk_counts)[n - 1];
+        for (n = 0; n < np; ++n)
+        {
+            (*chunk_counts)[n] = NHOURS * (bounds[n + 1] - bounds[n]);
+            (*chunk_displs)[n] = NHOURS * bounds[n];
+        }
 
         printf(DONE_MSG);
-        printf("Chunk size: \e[1m%d\e[22m (master), \e[1m%d\e[22m (slaves)\n", master_chunk_size, slaves_chunk_size);
+        printf("Chunk sizes:");
+        for (n = 0; n < np; ++n)
+            printf(" \e[1m%d\e[22m", bounds[n + 1] - bounds[n]);
+        printf("\n");
     }
-    else
+
+    *chunk_start = bounds[pid];
+    *chunk_size = bounds[pid + 1] - bounds[pid];
+    *chunk_data = allocate_chunk_data(arena, halo, *chunk_size);
+    if (*chunk_data == NULL)
     {
-        *chunk_size = slaves_chunk_size;
-        *chunk_data = malloc(NHOURS * *chunk_size * sizeof **chunk_data);
-        if (*chunk_data == NULL)
-        {
-            fprintf(stderr, FAILED_MSG "%d:" ERROR_MSG "Chunk data error.\n", pid);
-            return 0;
-        }
+        fprintf(stderr, "%d:" ERROR_MSG "Chunk data error.\n", pid);
+        return 0;
     }
 
+    knn_first_touch(*chunk_data, *chunk_size);
+
     return 1;
 }
 
@@ -232,111 +492,359 @@ static int scatter_chunks(int pid, float const *data, int const *chunk_counts, i
     return 1;
 }
 
-static void remap_chunk_to_global_indexes(int k, knn_neighbor *kn, int offset)
+/**
+ * @brief Sends the last @p halo rows of every chunk to the next process,
+ * which stores them right before its own chunk.
+ *
+ * @param           pid         Process id.
+ * @param           np          Number of processes.
+ * @param           halo        Halo rows.
+ * @param[inout]    chunk_data  Chunk data.
+ * @param           chunk_size  Chunk size.
+ * @return On failure returns zero.
+ */
+static int exchange_halo(int pid, int np, int halo, float *chunk_data, int chunk_size)
 {
-    for (int nk = 0; nk < k; ++nk)
-        kn[nk].index += offset;
-}
+    int next, previous;
 
-static int find_npk_neighbors(int pid, int np, int k, int ndays, float *data, int chunk_start, float *chunk_data, int chunk_size, MPI_Datatype mpi_neighbor_type, knn_neighbor *npkn)
-{
-    float target[NHOURS];
-    knn_neighbor *nk = malloc(k * sizeof *nk);
+    if (halo == 0)
+        return 1;
 
     if (pid == 0)
-        printf("Getting npkn-Nearest Neighbors...");
+        printf("Exchanging halos...");
+
+    next = (pid + 1 < np) ? pid + 1 : MPI_PROC_NULL;
+    previous = (pid > 0) ? pid - 1 : MPI_PROC_NULL;
 
-    for (int current = 0; current < NPREDICTIONS; ++current)
+    if (MPI_Sendrecv(&chunk_data[(chunk_size - halo) * NHOURS], halo * NHOURS, MPI_FLOAT, next, 0,
+                     &chunk_data[-halo * NHOURS], halo * NHOURS, MPI_FLOAT, previous, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE) != MPI_SUCCESS)
     {
-        if (MPI_Scatter(&data[(ndays - NPREDICTIONS + current) * NHOURS], NHOURS, MPI_FLOAT, target, NHOURS, MPI_FLOAT, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
-        {
-            fprintf(stderr, FAILED_MSG "%d:" ERROR_MSG "Scatter error.\n", pid);
-            return 0;
-        }
+        fprintf(stderr, FAILED_MSG "%d:" ERROR_MSG "Exchanging halos error.\n", pid);
+        return 0;
+    }
+
+    if (pid == 0)
+        printf(DONE_MSG);
 
-        knn_kNN(k, target, chunk_data, chunk_size, nk);
-        remap_chunk_to_global_indexes(k, nk, chunk_start);
+    return 1;
+}
 
-        if (MPI_Gather(nk, k, mpi_neighbor_type, &npkn[current * np * k], k, mpi_neighbor_type, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
+/**
+ * @brief Calculates the predicted days and the days searched for neighbors.
+ *
+ * By default the last @c NPREDICTIONS days are predicted from the days
+ * before them. A backtest predicts every day of its window from the days
+ * strictly before it, starting once @p k complete windows exist.
+ *
+ * @param           pid             Process id.
+ * @param[in]       args            Arguments.
+ * @param           ndays           Number of days.
+ * @param[out]      first           First predicted day.
+ * @param[out]      npredictions    Number of predictions.
+ * @param[out]      ncandidates     Number of days to search for neighbors.
+ * @return On failure returns zero.
+ */
+static int calculate_query_range(int pid, struct knn_args const *args, int ndays, int *first, int *npredictions, int *ncandidates)
+{
+    int last;
+
+    if (!args->backtest)
+    {
+        *first = ndays - NPREDICTIONS;
+        *npredictions = NPREDICTIONS;
+        *ncandidates = *first;
+        if (*ncandidates - (args->window - 1) < args->k)
         {
-            fprintf(stderr, FAILED_MSG "%d:" ERROR_MSG "Gather error.\n", pid);
+            fprintf(stderr, "%d:" ERROR_MSG "Less than %d windows of %d days.\n", pid, args->k, args->window);
             return 0;
         }
+        return 1;
+    }
+
+    *first = (args->backtest_from > args->k + args->window - 1) ? args->backtest_from : args->k + args->window - 1;
+    last = (args->backtest_to == 0) ? ndays : args->backtest_to;
+    if (last > ndays || *first >= last)
+    {
+        fprintf(stderr, "%d:" ERROR_MSG "Invalid backtest window [%d, %d).\n", pid, *first, last);
+        return 0;
     }
 
+    *npredictions = last - *first;
+    *ncandidates = last - 1;
+
     if (pid == 0)
-        printf(DONE_MSG);
+        printf("Backtest days: [\e[1m%d\e[22m, \e[1m%d\e[22m)\n", *first, last);
 
-    free(nk);
     return 1;
 }
 
-static int find_k_neighbors(int pid, int np, int k, knn_neighbor *npkn, knn_neighbor *kn)
+/**
+ * @brief Broadcasts the targets (with their @p window - 1 halo days) and
+ * computes their statistics.
+ *
+ * @param[inout]    arena           Pipeline arena.
+ * @param           pid             Process id.
+ * @param[in]       metric          Distance metric.
+ * @param           window          Window days.
+ * @param           first           First predicted day.
+ * @param           npredictions    Number of predictions.
+ * @param[in]       data            Dataset data (master only).
+ * @param[out]      targets         First target row, halo rows before it.
+ * @param[out]      target_stats    First target statistics, halo ones before them.
+ * @return On failure returns zero.
+ */
+static int broadcast_targets(knn_arena *arena, int pid, knn_metric const *metric, int window, int first, int npredictions, float const *data, float **targets, knn_row_stats **target_stats)
+{
+    float *buffer;
+
+    buffer = knn_arena_alloc(arena, (window - 1 + npredictions) * NHOURS * sizeof *buffer);
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "%d:" ERROR_MSG "Targets buffer error.\n", pid);
+        return 0;
+    }
+
+    if (pid == 0)
+        memcpy(buffer, &data[(first - (window - 1)) * NHOURS], (window - 1 + npredictions) * NHOURS * sizeof *buffer);
+
+    if (MPI_Bcast(buffer, (window - 1 + npredictions) * NHOURS, MPI_FLOAT, 0, MPI_COMM_WORLD) != MPI_SUCCESS)
+    {
+        fprintf(stderr, "%d:" ERROR_MSG "Broadcast targets error.\n", pid);
+        return 0;
+    }
+
+    *targets = &buffer[(window - 1) * NHOURS];
+    return compute_row_stats(arena, pid, metric, window - 1, *targets, npredictions, target_stats);
+}
+
+/**
+ * @brief Finds the chunk k-Nearest Neighbors of a block of targets and
+ * gathers them, per target, on the master.
+ *
+ * @param           pid                 Process id.
+ * @param           np                  Number of processes.
+ * @param           k                   Number of neighbors.
+ * @param[in]       metric              Distance metric.
+ * @param           window              Window days.
+ * @param           first               Day of the first target of the block.
+ * @param           nblock              Number of targets of the block.
+ * @param[in]       targets             First target of the block.
+ * @param[in]       target_stats        First target statistics of the block.
+ * @param           chunk_start         Chunk start.
+ * @param[in]       chunk_data          Chunk data.
+ * @param[in]       chunk_stats         Chunk statistics.
+ * @param           chunk_size          Chunk size.
+ * @param[inout]    scratch             Search scratch.
+ * @param[inout]    workspace           Window search workspace.
+ * @param[out]      nk                  Chunk neighbors of the block.
+ * @param           mpi_neighbor_type   Neighbor MPI datatype.
+ * @param[out]      npkn                Gathered neighbors of the block (master only).
+ * @return On failure returns zero.
+ */
+static int find_npk_neighbors(int pid, int np, int k, knn_metric const *metric, int window, int first, int nblock, float const *targets, knn_row_stats const *target_stats,
+                              int chunk_start, float const *chunk_data, knn_row_stats const *chunk_stats, int chunk_size,
+                              knn_neighbor *scratch, void *workspace, knn_neighbor *nk, MPI_Datatype mpi_neighbor_type, knn_neighbor *npkn)
+{
+    MPI_Datatype mpi_strided_type = MPI_DATATYPE_NULL, mpi_block_type = MPI_DATATYPE_NULL;
+    int gather_ok;
+
+    if (window > 1)
+        knn_kNN_window(k, metric, window, nblock, targets, target_stats, first, chunk_data, chunk_stats, chunk_start, chunk_size, scratch, workspace, nk);
+    else
+        knn_kNN_batch(k, metric, nblock, targets, target_stats, first, chunk_data, chunk_stats, chunk_start, chunk_size, scratch, nk);
+
+    /* Rank neighbors of each prediction land contiguous: npkn[(prediction * np + rank) * k]. */
+    gather_ok = MPI_Type_vector(nblock, k, np * k, mpi_neighbor_type, &mpi_strided_type) == MPI_SUCCESS &&
+                MPI_Type_create_resized(mpi_strided_type, 0, k * sizeof *npkn, &mpi_block_type) == MPI_SUCCESS &&
+                MPI_Type_commit(&mpi_block_type) == MPI_SUCCESS &&
+                MPI_Gather(nk, nblock * k, mpi_neighbor_type, npkn, 1, mpi_block_type, 0, MPI_COMM_WORLD) == MPI_SUCCESS;
+
+    if (mpi_block_type != MPI_DATATYPE_NULL)
+        MPI_Type_free(&mpi_block_type);
+    if (mpi_strided_type != MPI_DATATYPE_NULL)
+        MPI_Type_free(&mpi_strided_type);
+
+    if (!gather_ok)
+    {
+        fprintf(stderr, "%d:" ERROR_MSG "Gather error.\n", pid);
+        return 0;
+    }
+
+    return 1;
+}
+
+static int find_k_neighbors(int pid, int np, int k, int nblock, knn_neighbor const *npkn, knn_neighbor *kn)
 {
     if (pid == 0)
     {
-        printf("Getting k-Nearest Neighbors...");
 #pragma omp parallel for
-        for (int current = 0; current < NPREDICTIONS; ++current)
-        {
-            knn_bubble_sort_array(k, &npkn[current * np * k], 1);
-            for (int i = 0; i < k; ++i)
-                kn[i + k * current] = npkn[i + np * k * current];
-        }
-        printf(DONE_MSG);
+        for (int current = 0; current < nblock; ++current)
+            knn_merge_neighbors(k, np, &npkn[current * np * k], k, 1, &kn[current * k]);
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Opens the checkpoint of the run (master only) and broadcasts how
+ * many predictions it already holds.
+ *
+ * @param           pid             Process id.
+ * @param[in]       args            Arguments.
+ * @param[in]       metric          Distance metric.
+ * @param           ndays           Number of days.
+ * @param[in]       data            Dataset data (master only).
+ * @param           first           First predicted day.
+ * @param           npredictions    Number of predictions.
+ * @param[out]      checkpoint      Checkpoint.
+ * @param[out]      kn              Neighbors of the finished predictions (master only).
+ * @param[out]      done            Number of finished predictions.
+ * @return On failure returns zero.
+ */
+static int open_checkpoint(int pid, struct knn_args const *args, knn_metric const *metric, int ndays, float const *data, int first, int npredictions, knn_checkpoint *checkpoint, knn_neighbor *kn, int *done)
+{
+    knn_checkpoint_header header;
+    int progress[2] = {1, 0};
+
+    if (pid == 0)
+    {
+        memset(&header, 0, sizeof header);
+        memcpy(header.magic, KNN_CHECKPOINT_MAGIC, sizeof header.magic);
+        header.k = args->k;
+        header.ndays = ndays;
+        header.first = first;
+        header.npredictions = npredictions;
+        header.window = args->window;
+        header.metric = metric->kind;
+        header.checksum = knn_checkpoint_checksum(data, ndays);
+        memcpy(header.weights, metric->weights, sizeof header.weights);
+
+        progress[0] = knn_checkpoint_open(checkpoint, args->checkpoint, &header, kn, &progress[1]);
+        if (progress[0])
+            printf("Checkpoint: \e[1m%d\e[22m of \e[1m%d\e[22m predictions done\n", progress[1], npredictions);
     }
 
+    if (MPI_Bcast(progress, 2, MPI_INT, 0, MPI_COMM_WORLD) != MPI_SUCCESS || !progress[0])
+    {
+        fprintf(stderr, "%d:" ERROR_MSG "Checkpoint open error.\n", pid);
+        return 0;
+    }
+
+    *done = progress[1];
     return 1;
 }
 
-static int find_neighbors(int pid, int np, int k, int ndays, float *data, int chunk_start, int chunk_size, float *chunk_data, knn_neighbor **neighbors)
+/**
+ * @brief Finds the k-Nearest Neighbors of every prediction, block by block.
+ *
+ * With a checkpoint, predictions it already holds are skipped and every
+ * finished block is queued to it, written in the background.
+ *
+ * @param[inout]    arena           Pipeline arena.
+ * @param[in]       args            Arguments.
+ * @param           pid             Process id.
+ * @param[in]       metric          Distance metric.
+ * @param           ndays           Number of days.
+ * @param           first           First predicted day.
+ * @param           npredictions    Number of predictions.
+ * @param[in]       data            Dataset data (master only).
+ * @param           chunk_start     Chunk start.
+ * @param           chunk_size      Chunk size.
+ * @param[in]       chunk_data      Chunk data.
+ * @param[in]       chunk_stats     Chunk statistics.
+ * @param[out]      neighbors       Neighbors of every prediction (master only).
+ * @return On failure returns zero.
+ */
+static int find_neighbors(knn_arena *arena, struct knn_args const *args, int pid, knn_metric const *metric, int ndays, int first, int npredictions, float const *data,
+                          int chunk_start, int chunk_size, float const *chunk_data, knn_row_stats const *chunk_stats, knn_neighbor **neighbors)
 {
-    knn_neighbor *kn, *npkn;
+    int np = args->np, k = args->k, window = args->window, block_size, nblock, done = 0, find_ok = 1;
+    float *targets;
+    knn_row_stats *target_stats;
+    knn_neighbor *kn = NULL, *npkn = NULL, *nk, *scratch;
+    void *workspace = NULL;
+    knn_checkpoint checkpoint;
 
     int blocklengths[] = {1, 1};
     MPI_Datatype types[] = {MPI_FLOAT, MPI_INT};
     MPI_Datatype mpi_neighbor_type;
     MPI_Aint offsets[] = {offsetof(knn_neighbor, eval), offsetof(knn_neighbor, index)};
 
-    MPI_Type_create_struct(2, blocklengths, offsets, types, &mpi_neighbor_type);
-    MPI_Type_commit(&mpi_neighbor_type);
+    block_size = (args->checkpoint != NULL && args->checkpoint_every < npredictions) ? args->checkpoint_every : npredictions;
 
+    nk = knn_arena_alloc(arena, block_size * k * sizeof *nk);
+    scratch = knn_arena_alloc(arena, block_size * omp_get_max_threads() * k * sizeof *scratch);
+    if (window > 1)
+        workspace = knn_arena_alloc(arena, omp_get_max_threads() * knn_kNN_window_workspace(window));
     if (pid == 0)
     {
-        kn = *neighbors = malloc(k * NPREDICTIONS * sizeof *kn);
-        if (kn == NULL)
-            return 0;
+        kn = *neighbors = knn_arena_alloc(arena, k * npredictions * sizeof *kn);
+        npkn = knn_arena_alloc(arena, np * k * block_size * sizeof *npkn);
+    }
+    if (nk == NULL || scratch == NULL || (window > 1 && workspace == NULL) || (pid == 0 && (kn == NULL || npkn == NULL)))
+    {
+        fprintf(stderr, "%d:" ERROR_MSG "Neighbors buffer error.\n", pid);
+        return 0;
+    }
 
-        npkn = malloc(np * k * NPREDICTIONS * sizeof *npkn);
-        if (npkn == NULL)
-            return 0;
+    TRY(broadcast_targets(arena, pid, metric, window, first, npredictions, data, &targets, &target_stats), 0);
+
+    if (MPI_Type_create_struct(2, blocklengths, offsets, types, &mpi_neighbor_type) != MPI_SUCCESS)
+    {
+        fprintf(stderr, "%d:" ERROR_MSG "Neighbor datatype error.\n", pid);
+        return 0;
     }
 
-    find_npk_neighbors(pid, np, k, ndays, data, chunk_start, chunk_data, chunk_size, mpi_neighbor_type, npkn);
-    find_k_neighbors(pid, np, k, npkn, kn);
+    if (MPI_Type_commit(&mpi_neighbor_type) != MPI_SUCCESS ||
+        (args->checkpoint != NULL && !open_checkpoint(pid, args, metric, ndays, data, first, npredictions, &checkpoint, kn, &done)))
+    {
+        fprintf(stderr, "%d:" ERROR_MSG "Neighbors setup error.\n", pid);
+        MPI_Type_free(&mpi_neighbor_type);
+        return 0;
+    }
 
-    free(npkn);
+    if (pid == 0)
+        printf("Getting k-Nearest Neighbors...");
+
+    for (int block = done; block < npredictions && find_ok; block += nblock)
+    {
+        nblock = (npredictions - block < block_size) ? npredictions - block : block_size;
+
+        find_ok = find_npk_neighbors(pid, np, k, metric, window, first + block, nblock, &targets[block * NHOURS], &target_stats[block],
+                                     chunk_start, chunk_data, chunk_stats, chunk_size, scratch, workspace, nk, mpi_neighbor_type, npkn) &&
+                  find_k_neighbors(pid, np, k, nblock, npkn, &kn[block * k]);
+
+        if (find_ok && pid == 0 && args->checkpoint != NULL)
+            find_ok = knn_checkpoint_write(&checkpoint, block, nblock, &kn[block * k]);
+    }
+
+    if (pid == 0)
+        printf(find_ok ? DONE_MSG : FAILED_MSG);
+
+    /* Finished blocks are flushed even when the search failed, so a restart resumes after them. */
+    if (pid == 0 && args->checkpoint != NULL)
+        find_ok = knn_checkpoint_close(&checkpoint) && find_ok;
 
     MPI_Type_free(&mpi_neighbor_type);
 
-    return 1;
+    return find_ok;
 }
 
-static int make_predictions(int pid, int k, int ndays, float *data, knn_neighbor *neighbors, float **predictions, float **mape)
+static int make_predictions(knn_arena *arena, int pid, int k, int first, int npredictions, float *data, knn_neighbor *neighbors, float **predictions, float **mape)
 {
     if (pid == 0)
     {
         printf("Make predictions...");
 
-        *predictions = malloc(NPREDICTIONS * NHOURS * sizeof *predictions);
+        *predictions = knn_arena_alloc(arena, npredictions * NHOURS * sizeof **predictions);
         if (*predictions == NULL)
             return 0;
 
-        *mape = malloc(NPREDICTIONS * sizeof *mape);
+        *mape = knn_arena_alloc(arena, npredictions * sizeof **mape);
         if (*mape == NULL)
             return 0;
 
-        knn_predictions(k, ndays, neighbors, data, *predictions, *mape);
+        knn_predictions(k, first, npredictions, neighbors, data, *predictions, *mape);
 
         printf(DONE_MSG);
     }
@@ -344,14 +852,14 @@ static int make_predictions(int pid, int k, int ndays, float *data, knn_neighbor
     return 1;
 }
 
-static int save_predictions(int pid, char const *filename, float *predictions)
+static int save_predictions(int pid, char const *filename, int npredictions, float *predictions)
 {
     int save_ok;
 
     if (pid == 0)
     {
         printf("Saving predictions...");
-        save_ok = knn_save_predictions(filename, predictions);
+        save_ok = knn_save_predictions(filename, npredictions, predictions);
         if (!save_ok)
         {
             fprintf(stderr, FAILED_MSG "%d:" ERROR_MSG "Saving predictions error.\n", pid);
@@ -363,14 +871,14 @@ static int save_predictions(int pid, char const *filename, float *predictions)
     return 1;
 }
 
-static int save_mape(int pid, char const *filename, float *mape)
+static int save_mape(int pid, char const *filename, int npredictions, float *mape)
 {
     int save_ok;
 
     if (pid == 0)
     {
         printf("Saving mape...");
-        save_ok = knn_save_mape(filename, mape);
+        save_ok = knn_save_mape(filename, npredictions, mape);
         if (!save_ok)
         {
             fprintf(stderr, FAILED_MSG "%d:" ERROR_MSG "Saving mape error.\n", pid);
@@ -383,57 +891,75 @@ static int save_mape(int pid, char const *filename, float *mape)
 }
 
 /**
- * @brief Executes program.
+ * @brief Runs the k-NN pipeline over a loaded dataset.
  *
- * @param[in]   filename    Dataset filename.
- * @param       k           Number of neighbors.
- * @param       np          Number of processes.
- * @param       nt          Number of threads.
- * @param       pid         Process id.
+ * @param[inout]    arena   Pipeline arena.
+ * @param[in]       args    Arguments.
+ * @param           pid     Process id.
+ * @param           ndays   Number of days.
+ * @param[in]       data    Dataset data (master only).
  * @return On failure returns zero.
  */
-static int exec(char const *filename, int k, int np, int nt, int pid)
+static int run_pipeline(knn_arena *arena, struct knn_args const *args, int pid, int ndays, float *data)
 {
-    float *data, *chunk_data, *predictions, *mape;
-    int ndays, chunk_start, chunk_size, *chunk_counts, *chunk_displs;
+    float *chunk_data, *predictions, *mape;
+    int first, npredictions, ncandidates, chunk_start, chunk_size, *chunk_counts, *chunk_displs;
+    knn_row_stats *chunk_stats;
     knn_neighbor *neighbors;
+    knn_metric metric;
 
-    TRY(load_dataset(pid, filename, &ndays, &data), 0);
     TRY(broadcast_ndays(pid, &ndays), 0)
-    TRY(initialize_chunk_metadata(pid, np, ndays - NPREDICTIONS, &chunk_size, &chunk_data, &chunk_counts, &chunk_displs), 0);
+    TRY(setup_metric(pid, args, &metric), 0);
+    TRY(calculate_query_range(pid, args, ndays, &first, &npredictions, &ncandidates), 0);
+    TRY(initialize_chunk_metadata(arena, pid, args->np, first, npredictions, ncandidates, args->window - 1, &chunk_start, &chunk_size, &chunk_data, &chunk_counts, &chunk_displs), 0);
     TRY(scatter_chunks(pid, data, chunk_counts, chunk_displs, chunk_data, chunk_size), 0)
-    if (pid == 0)
-        free(chunk_counts), free(chunk_displs);
+    TRY(exchange_halo(pid, args->np, args->window - 1, chunk_data, chunk_size), 0);
+    TRY(compute_row_stats(arena, pid, &metric, args->window - 1, chunk_data, chunk_size, &chunk_stats), 0);
+    TRY(find_neighbors(arena, args, pid, &metric, ndays, first, npredictions, data, chunk_start, chunk_size, chunk_data, chunk_stats, &neighbors), 0);
+    TRY(make_predictions(arena, pid, args->k, first, npredictions, data, neighbors, &predictions, &mape), 0);
+    TRY(save_predictions(pid, "out/predictions.txt", npredictions, predictions), 0);
+    TRY(save_mape(pid, "out/mape.txt", npredictions, mape), 0);
 
-    TRY(find_neighbors(pid, np, k, ndays, data, chunk_start, chunk_size, chunk_data, &neighbors), 0);
-    free(chunk_data);
-    TRY(make_predictions(pid, k, ndays, data, neighbors, &predictions, &mape), 0);
-    if (pid == 0)
-        free(data), free(neighbors);
+    return 1;
+}
 
-    {
-        TRY(save_predictions(pid, "out/predictions.txt", predictions), 0);
-        if (pid == 0)
-            free(predictions);
-    }
-    {
-        TRY(save_mape(pid, "out/mape.txt", mape), 0);
-        if (pid == 0)
-            free(mape);
-    }
+/**
+ * @brief Executes program.
+ *
+ * Every pipeline buffer comes from @p arena , which is reset on entry so
+ * repeated runs reuse the same memory.
+ *
+ * @param[inout]    arena   Per-rank pipeline arena.
+ * @param[in]       args    Arguments.
+ * @param           pid     Process id.
+ * @return On failure returns zero.
+ */
+static int exec(knn_arena *arena, struct knn_args const *args, int pid)
+{
+    float *data = NULL;
+    int ndays, exec_ok;
 
-    return 1;
+    knn_arena_reset(arena);
+
+    TRY(load_dataset(pid, args->filename, &ndays, &data), 0);
+    exec_ok = run_pipeline(arena, args, pid, ndays, data);
+    free(data);
+
+    return exec_ok;
 }
 
 int main(int argc, char **argv)
 {
     struct knn_args args;
-    double time;
+    knn_arena arena;
+    double time, run_time;
     int pid;
 
     MPI_Init(&argc, &argv);
     MPI_Comm_rank(MPI_COMM_WORLD, &pid);
     MPI_Comm_size(MPI_COMM_WORLD, &args.np);
+    /* Let failed calls return (every one is checked), so the checkpoint is flushed before aborting. */
+    MPI_Comm_set_errhandler(MPI_COMM_WORLD, MPI_ERRORS_RETURN);
 
     if (pid == 0)
         time = MPI_Wtime();
@@ -445,15 +971,37 @@ int main(int argc, char **argv)
     }
 
     omp_set_num_threads(args.nt);
-    if (!exec(args.filename, args.k, args.np, args.nt, pid))
+    if (!knn_bind_threads(args.bind, MPI_COMM_WORLD) || !report_affinity(pid, args.np, args.nt))
+    {
+        fprintf(stderr, "%d:" ERROR_MSG "Thread placement aborted.\n", pid);
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+
+    if (!knn_arena_init(&arena, 0))
     {
-        fprintf(stderr, "%d:" ERROR_MSG "Error: Execution aborted.\n", pid);
+        fprintf(stderr, "%d:" ERROR_MSG "Arena initialization aborted.\n", pid);
         MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
     }
 
+    for (int run = 0; run < args.repeat; ++run)
+    {
+        if (pid == 0)
+            run_time = MPI_Wtime();
+
+        if (!exec(&arena, &args, pid))
+        {
+            fprintf(stderr, "%d:" ERROR_MSG "Error: Execution aborted.\n", pid);
+            MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+        }
+
+        if (pid == 0 && args.repeat > 1)
+            printf("Run \e[1m%d\e[22m time: \e[1m%.3lfs\e[0m\n", run, MPI_Wtime() - run_time);
+    }
+
     if (pid == 0)
         printf("Total execution time: \e[1m%.3lfs\e[0m\n", MPI_Wtime() - time);
 
+    knn_arena_free(&arena);
     MPI_Finalize();
 
     return EXIT_SUCCESS;